@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE // For SO_BUSY_POLL and other non POSIX socket options.
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -11,6 +12,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "chatlib.h"
+
+/* Older libc headers may lack it, but the kernel supports it since 3.11. */
+#if defined(__linux__) && !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL 46
+#endif
 
 /* ======================== Low level networking stuff ==========================
  * Here you will find basic socket stuff that should be part of
@@ -34,6 +43,36 @@ int socketSetNonBlockNoDelay(int fd) {
     return 0;
 }
 
+/* Enable kernel busy polling for the socket: a read that finds no data
+ * will poll the device receive queue for up to 'usec' microseconds instead
+ * of sleeping until the next interrupt. This trades CPU for latency. The
+ * kernel can only busy poll sockets whose packets arrive via a network
+ * driver using NAPI: for other sockets the option is set but does nothing.
+ * Values above net.core.busy_read need CAP_NET_ADMIN. Returns -1 if the
+ * option is not supported or can't be set, otherwise 0. */
+int socketSetBusyPoll(int fd, int usec) {
+#ifdef SO_BUSY_POLL
+    int val;
+    socklen_t len = sizeof(val);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1)
+        return -1;
+
+    /* Make sure the kernel really took the value. */
+    if (getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, &len) == -1)
+        return -1;
+    if (val != usec) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+#else
+    (void)fd; (void)usec;
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
 /* Create a TCP socket listening to 'port' ready to accept connections. */
 int createTCPServer(int port) {
     int s, yes = 1;
@@ -151,3 +190,130 @@ void *chatRealloc(void *ptr, size_t size) {
     }
     return ptr;
 }
+
+/* Return the current time in microseconds, from a monotonic clock. */
+long long ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Compare function to qsort() an array of long long. */
+static int compareLongLong(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* Print the latency distribution of the 'count' samples in 'lat', in
+ * microseconds, as "key: value" lines. The array is sorted in place. */
+void printLatencyStats(long long *lat, long long count) {
+    if (count == 0) return;
+    qsort(lat,count,sizeof(long long),compareLongLong);
+
+    long long sum = 0;
+    for (long long j = 0; j < count; j++) sum += lat[j];
+    printf("latency_us_avg: %.1f\n", (double)sum/count);
+
+    double perc[] = {50, 90, 99, 99.9};
+    for (size_t j = 0; j < sizeof(perc)/sizeof(perc[0]); j++) {
+        long long idx = (long long)(count*perc[j]/100);
+        if (idx >= count) idx = count-1;
+        printf("latency_us_p%g: %lld\n", perc[j], lat[idx]);
+    }
+    printf("latency_us_max: %lld\n", lat[count-1]);
+}
+
+/* ============================= Traffic capture ===============================
+ * The server is able to record what its clients send into a capture file,
+ * so that the same traffic can be replayed later by smallchat-replay.
+ * The file starts with the CAPTURE_MAGIC string, followed by records:
+ *
+ *   <type> <delta> <conn> [<len> <data>]
+ *
+ * 'type' is a single byte, one of CAPTURE_CONNECT, CAPTURE_DATA and
+ * CAPTURE_CLOSE. 'delta' is the number of microseconds elapsed since the
+ * previous record. 'conn' identifies the connection: it is just the client
+ * file descriptor, since the kernel may reuse it only after the connection
+ * is closed. 'len' and 'data' are only present in CAPTURE_DATA records, and
+ * are the bytes read from the client.
+ *
+ * Since connection IDs are file descriptors, they are never greater than
+ * the open files limit. Readers reject IDs above CAPTURE_MAX_CONN, well
+ * beyond any realistic limit, so that a corrupted file can't make the
+ * replay index (or allocate) huge arrays.
+ *
+ * All the numbers are stored as varints: 7 bits per byte, least significant
+ * group first, with the most significant bit set if more bytes follow. Most
+ * deltas, connection IDs and lengths fit in one or two bytes.
+ * =========================================================================== */
+
+/* Write 'v' as a varint to the buffer 'buf', that must have room for at
+ * least 10 bytes. Returns the number of bytes used. */
+static int encodeVarint(unsigned char *buf, unsigned long long v) {
+    int len = 0;
+    while (v >= 0x80) {
+        buf[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    return len;
+}
+
+/* Read a varint from 'fp' into 'v'. Returns 0 on success, -1 on EOF or
+ * if the varint is malformed. */
+static int readVarint(FILE *fp, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(fp);
+        if (c == EOF) return -1;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+/* Append a record to the capture file. 'data' and 'len' are ignored
+ * if the type is not CAPTURE_DATA. Returns 0 on success, -1 on error. */
+int captureWriteRecord(FILE *fp, int type, unsigned long long delta,
+                       int conn, const char *data, size_t len)
+{
+    unsigned char hdr[31]; // Type byte plus three varints.
+    int hdrlen = 0;
+
+    hdr[hdrlen++] = type;
+    hdrlen += encodeVarint(hdr+hdrlen,delta);
+    hdrlen += encodeVarint(hdr+hdrlen,conn);
+    if (type == CAPTURE_DATA) hdrlen += encodeVarint(hdr+hdrlen,len);
+    if (fwrite(hdr,hdrlen,1,fp) != 1) return -1;
+    if (type == CAPTURE_DATA && len && fwrite(data,len,1,fp) != 1) return -1;
+    return 0;
+}
+
+/* Read the next record from the capture file into 'r'. The record data
+ * buffer is reused and grown as needed across calls: set r->data to NULL
+ * and r->size to zero before the first call, and free r->data when done.
+ * Returns 1 if a record was read, 0 on end of file, -1 if the file is
+ * corrupted or truncated. */
+int captureReadRecord(FILE *fp, struct captureRecord *r) {
+    unsigned long long delta, conn, len = 0;
+
+    int type = getc(fp);
+    if (type == EOF) return 0;
+    if (type != CAPTURE_CONNECT && type != CAPTURE_DATA &&
+        type != CAPTURE_CLOSE) return -1;
+    if (readVarint(fp,&delta) == -1 || readVarint(fp,&conn) == -1) return -1;
+    if (conn > CAPTURE_MAX_CONN) return -1;
+    if (type == CAPTURE_DATA) {
+        if (readVarint(fp,&len) == -1 || len > CAPTURE_MAX_DATA) return -1;
+        if (len > r->size) {
+            r->data = chatRealloc(r->data,len);
+            r->size = len;
+        }
+        if (len && fread(r->data,len,1,fp) != 1) return -1;
+    }
+    r->type = type;
+    r->delta = delta;
+    r->conn = conn;
+    r->len = len;
+    return 1;
+}
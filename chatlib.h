@@ -1,14 +1,44 @@
 #ifndef CHATLIB_H
 #define CHATLIB_H
 
+#include <stdio.h>
+
 /* Networking. */
 int createTCPServer(int port);
 int socketSetNonBlockNoDelay(int fd);
 int acceptClient(int server_socket);
+int socketSetBusyPoll(int fd, int usec);
 int TCPConnect(char *addr, int port, int nonblock);
 
 /* Allocation. */
 void *chatMalloc(size_t size);
 void *chatRealloc(void *ptr, size_t size);
 
+/* Time. */
+long long ustime(void);
+
+/* Statistics. */
+void printLatencyStats(long long *lat, long long count);
+
+/* Traffic capture. */
+#define CAPTURE_MAGIC "SCCAP001"    // First 8 bytes of a capture file.
+#define CAPTURE_CONNECT 'C'         // A client connected.
+#define CAPTURE_DATA 'D'            // A client sent some data.
+#define CAPTURE_CLOSE 'X'           // A client disconnected.
+#define CAPTURE_MAX_DATA (1<<20)    // Sanity limit for a single record.
+#define CAPTURE_MAX_CONN (1<<22)    // Sanity limit for connection IDs.
+
+struct captureRecord {
+    int type;                   // CAPTURE_CONNECT, CAPTURE_DATA, ...
+    unsigned long long delta;   // Microseconds since the previous record.
+    int conn;                   // Connection ID.
+    size_t len;                 // Length of 'data' for CAPTURE_DATA.
+    char *data;                 // Data buffer, reused across reads.
+    size_t size;                // Allocated size of 'data'.
+};
+
+int captureWriteRecord(FILE *fp, int type, unsigned long long delta,
+                       int conn, const char *data, size_t len);
+int captureReadRecord(FILE *fp, struct captureRecord *r);
+
 #endif // CHATLIB_H
@@ -0,0 +1,273 @@
+/* smallchat-bench.c -- Benchmarking tool for the smallchat server.
+ *
+ * Copyright (c) 2023, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the project name of nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "chatlib.h"
+
+/* =============================================================================
+ * This program opens a given number of idle connections to a smallchat
+ * server, and reports how much memory the server used for them. This is
+ * useful in order to check the per-client footprint of the server.
+ *
+ * The memory is measured reading the resident set size of the server
+ * process from /proc, so the server pid must be given and this only
+ * works on Linux. Note that the kernel memory used for the sockets is not
+ * accounted: it is the memory of the server process itself that we check.
+ *
+ * With --latency <count> the program also measures the latency of the
+ * server: two more clients are connected, and one sends <count> messages,
+ * one after the other, while the other measures how long it takes to
+ * receive every message from the server. Running it against the server in
+ * the default mode and in low latency mode (--busy-poll) shows the
+ * difference in the latency distribution.
+ * ========================================================================== */
+
+#define CONNECT_BATCH 1000 // Clients connected before waiting for welcomes.
+#define LATENCY_WARMUP 100 // Messages sent before measuring the latency.
+
+/* Return the resident set size of the process 'pid' in bytes, or
+ * -1 if it can't be obtained. */
+long long getProcessRSS(int pid) {
+    char path[64], line[256];
+    long long rss = -1;
+
+    snprintf(path,sizeof(path),"/proc/%d/status",pid);
+    FILE *fp = fopen(path,"r");
+    if (fp == NULL) return -1;
+    while (fgets(line,sizeof(line),fp) != NULL) {
+        if (!strncmp(line,"VmRSS:",6)) {
+            rss = strtoll(line+6,NULL,10)*1024;
+            break;
+        }
+    }
+    fclose(fp);
+    return rss;
+}
+
+/* Connect to the IPv4 address 'addr' and 'port'. A single source address
+ * can have at most ~28k connections open to the same server (one per
+ * ephemeral port), so when connecting to the loopback interface we spread
+ * the connections among 127.0.0.1 ... 127.0.0.250 as source address,
+ * according to 'id'. Returns the socket or -1 on error. */
+int benchConnect(char *addr, int port, int id) {
+    struct sockaddr_in sa;
+    int s;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (inet_pton(AF_INET,addr,&sa.sin_addr) != 1) return -1;
+    if ((s = socket(AF_INET,SOCK_STREAM,0)) == -1) return -1;
+
+    if ((ntohl(sa.sin_addr.s_addr) >> 24) == 127) {
+        struct sockaddr_in src;
+        memset(&src,0,sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001 + id % 250);
+        if (bind(s,(struct sockaddr*)&src,sizeof(src)) == -1) {
+            close(s);
+            return -1;
+        }
+    }
+
+    if (connect(s,(struct sockaddr*)&sa,sizeof(sa)) == -1) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* Read from 's' till a newline is received. Returns 0 on success, -1
+ * if the connection was closed. Whatever is after the newline is discarded,
+ * but in the latency test nothing is sent before the line is received. */
+int readLine(int s) {
+    char buf[256];
+    while (1) {
+        ssize_t nread = read(s,buf,sizeof(buf));
+        if (nread <= 0) return -1;
+        if (memchr(buf,'\n',nread)) return 0;
+    }
+}
+
+/* Run the latency test described at the top of this file. 'id' is used
+ * to select the source address of the two clients, see benchConnect(). */
+void runLatencyTest(char *host, int port, int count, int id) {
+    int sender = benchConnect(host,port,id);
+    int receiver = benchConnect(host,port,id+1);
+    if (sender == -1 || receiver == -1) {
+        perror("Connecting latency test clients");
+        exit(1);
+    }
+    int yes = 1;
+    setsockopt(sender,IPPROTO_TCP,TCP_NODELAY,&yes,sizeof(yes));
+    setsockopt(receiver,IPPROTO_TCP,TCP_NODELAY,&yes,sizeof(yes));
+
+    if (readLine(sender) == -1 || readLine(receiver) == -1) {
+        fprintf(stderr,"Latency test: connection lost\n");
+        exit(1);
+    }
+
+    long long *lat = chatMalloc(sizeof(long long)*count);
+    char *msg = "ping\n";
+    for (int j = -LATENCY_WARMUP; j < count; j++) {
+        long long start = ustime();
+        if (write(sender,msg,strlen(msg)) != (ssize_t)strlen(msg) ||
+            readLine(receiver) == -1)
+        {
+            fprintf(stderr,"Latency test: connection lost\n");
+            exit(1);
+        }
+        if (j >= 0) lat[j] = ustime()-start;
+    }
+
+    printf("latency_messages: %d\n", count);
+    printLatencyStats(lat,count);
+    free(lat);
+    close(sender);
+    close(receiver);
+}
+
+void usage(char *progname) {
+    fprintf(stderr,
+        "Usage: %s [--host <ipv4>] [--port <port>] [--clients <count>]\n"
+        "          [--pid <server-pid>] [--latency <count>] [--hold]\n",
+        progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    int port = 7711, numclients = -1, pid = 0, hold = 0, latency = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--host") && moreargs) {
+            host = argv[++j];
+        } else if (!strcmp(argv[j],"--port") && moreargs) {
+            port = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--clients") && moreargs) {
+            numclients = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--pid") && moreargs) {
+            pid = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--latency") && moreargs) {
+            latency = atoi(argv[++j]);
+            if (latency <= 0) usage(argv[0]);
+        } else if (!strcmp(argv[j],"--hold")) {
+            hold = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    /* By default the latency test runs without idle clients, otherwise
+     * 1000 idle clients are connected. */
+    if (numclients == -1) numclients = latency ? 0 : 1000;
+    if (numclients < 0) usage(argv[0]);
+
+    /* We need a file descriptor for each client: raise the limit as
+     * much as we can. */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE,&rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE,&rl);
+    }
+
+    long long rss_before = pid ? getProcessRSS(pid) : -1;
+    long long start = ustime();
+    int *fds = chatMalloc(sizeof(int)*numclients);
+    int connected = 0;
+
+    /* Connect the clients in batches. After each batch we wait for the
+     * welcome message of every client of the batch: this way we know
+     * the server accepted them, and we don't overflow the listen
+     * backlog of the server. */
+    while (connected < numclients) {
+        int batch = numclients-connected;
+        if (batch > CONNECT_BATCH) batch = CONNECT_BATCH;
+
+        for (int j = connected; j < connected+batch; j++) {
+            fds[j] = benchConnect(host,port,j);
+            if (fds[j] == -1) {
+                fprintf(stderr,"Connecting client %d: %s\n",
+                    j, strerror(errno));
+                exit(1);
+            }
+        }
+        for (int j = connected; j < connected+batch; j++) {
+            char buf[256];
+            if (read(fds[j],buf,sizeof(buf)) <= 0) {
+                fprintf(stderr,"Client %d: connection lost\n", j);
+                exit(1);
+            }
+        }
+        connected += batch;
+        if (connected % 100000 == 0)
+            printf("%d clients connected\n", connected);
+    }
+
+    long long elapsed = ustime()-start;
+    if (connected) printf("%d clients connected in %.2f seconds\n",
+        connected, (double)elapsed/1000000);
+
+    if (pid && connected) {
+        long long rss_after = getProcessRSS(pid);
+        if (rss_before == -1 || rss_after == -1) {
+            fprintf(stderr,"Unable to read the RSS of pid %d\n", pid);
+        } else {
+            printf("Server RSS: %lld -> %lld bytes, %.1f bytes per client\n",
+                rss_before, rss_after,
+                (double)(rss_after-rss_before)/connected);
+        }
+    }
+
+    if (latency) runLatencyTest(host,port,latency,connected);
+
+    /* Keep the connections open, if requested, so that the server
+     * can be inspected while the clients are connected. */
+    if (hold) {
+        printf("Holding the connections open, press Ctrl+C to exit.\n");
+        while(1) pause();
+    }
+
+    for (int j = 0; j < connected; j++) close(fds[j]);
+    free(fds);
+    return 0;
+}
@@ -0,0 +1,497 @@
+/* smallchat-replay.c -- Replay traffic captured by the smallchat server.
+ *
+ * Copyright (c) 2023, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the project name of nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "chatlib.h"
+
+/* =============================================================================
+ * This program reads a capture file produced by smallchat-server --capture
+ * and sends the same traffic again to a server, opening and closing the
+ * connections and sending the data in the same order, at the original
+ * speed, N times faster, or as fast as possible. At the end a report is
+ * printed, in a "key: value" format that is easy to diff between builds.
+ *
+ * Records are replayed one after the other by a single thread, so the
+ * ordering of the data sent by each connection is preserved.
+ *
+ * To measure latency, an extra "probe" connection that never sends anything
+ * is opened: every chat message the server broadcasts also reaches it.
+ * The replay splits the data sent into lines exactly like the server does,
+ * and remembers the text and the send time of every line the server will
+ * broadcast. Every line received by the probe, in the form "nick> text", is
+ * matched by content with the oldest pending message having the same text.
+ * Two clients sending the same text at about the same time may have their
+ * latencies swapped, but that doesn't change the distribution.
+ *
+ * Messages the server dropped (because the probe was a slow consumer) stay
+ * pending: they are counted as lost once MATCH_WINDOW newer messages were
+ * sent, or when the replay ends. Lines received that don't match anything
+ * are counted as unexpected. This way a single lost or split message does
+ * not shift the latency of all the following ones, and the report shows
+ * exactly how many messages were not measured.
+ * ========================================================================== */
+
+#define DRAIN_EVERY 64      // Check sockets for input every N records at max speed.
+#define FINAL_WAIT_US 2000000 // Max time to wait for the last broadcasts.
+#define MATCH_WINDOW 4096   // Max pending messages waiting for the probe.
+
+/* The server reads lines in a buffer of IOBUF_LEN bytes: lines that don't
+ * fit (one byte is used for the null term) are split in multiple messages.
+ * Messages sent are truncated to IOBUF_LEN bytes as well, newline included.
+ * See readFromClient() and processClientLine() in smallchat-server.c. */
+#define SERVER_LINE_MAX 511
+#define SERVER_MSG_MAX 512
+
+/* State of a replayed connection. */
+struct replayConn {
+    int fd;         // Socket connected to the server, or -1.
+    char *line;     // Current line being sent, or NULL.
+    int linelen;    // Length of the current line.
+};
+
+/* A message the server will broadcast, waiting to be received by the
+ * probe connection. */
+#define MSG_PENDING 0
+#define MSG_MATCHED 1
+#define MSG_LOST 2
+struct sentMsg {
+    long long time; // When the line was sent.
+    int state;      // MSG_PENDING, MSG_MATCHED or MSG_LOST.
+    char *text;     // Text of the message, without the nick.
+    int len;        // Length of 'text'.
+};
+
+/* Global state of the replay. */
+struct replayState {
+    char *host;
+    int port;
+    double speed;                // Replay speed multiplier, 0 = max speed.
+    struct replayConn *conns;    // Connections, indexed by capture ID.
+    int numconns;                // Number of entries in 'conns'.
+    struct pollfd *pollfds;      // Probe + open connections.
+    int numpollfds;
+    int pollfds_dirty;           // Connections changed: rebuild 'pollfds'.
+    int probe;                   // The probe connection socket.
+    int probe_welcomed;          // Probe received the welcome line.
+    char probe_line[SERVER_MSG_MAX]; // Current line received by the probe.
+    int probe_linelen;
+
+    /* Messages to match with the probe. Message N is stored in the slot
+     * N % MATCH_WINDOW: messages older than 'head' are no longer pending,
+     * so there is always room for 'numsent'. */
+    struct sentMsg sent[MATCH_WINDOW];
+    long long head, numsent;
+    long long matched, lost, received, unexpected;
+    long long *latencies;        // One for every matched message.
+    long long latencies_size;
+
+    /* Stats. */
+    long long connections;
+    long long bytes_sent;
+    long long bytes_received;
+    long long records;
+} R;
+
+/* Return the connection with the given capture ID, growing the
+ * connections array if needed. */
+struct replayConn *getConn(int id) {
+    assert(id >= 0);
+    if (id >= R.numconns) {
+        int newsize = R.numconns ? R.numconns*2 : 1024;
+        if (newsize <= id) newsize = id+1;
+        R.conns = chatRealloc(R.conns,sizeof(struct replayConn)*newsize);
+        for (int j = R.numconns; j < newsize; j++) {
+            memset(R.conns+j,0,sizeof(struct replayConn));
+            R.conns[j].fd = -1;
+        }
+        R.numconns = newsize;
+    }
+    return R.conns+id;
+}
+
+/* Rebuild the array of sockets to poll: the probe plus every open
+ * connection, that we need to drain as well, otherwise the server would
+ * drop messages for them. */
+void rebuildPollfds(void) {
+    R.pollfds = chatRealloc(R.pollfds,sizeof(struct pollfd)*(R.numconns+1));
+    R.numpollfds = 0;
+    R.pollfds[R.numpollfds].fd = R.probe;
+    R.pollfds[R.numpollfds++].events = POLLIN;
+    for (int j = 0; j < R.numconns; j++) {
+        if (R.conns[j].fd == -1) continue;
+        R.pollfds[R.numpollfds].fd = R.conns[j].fd;
+        R.pollfds[R.numpollfds++].events = POLLIN;
+    }
+    R.pollfds_dirty = 0;
+}
+
+/* Advance 'head' past the messages that are no longer pending. */
+void advanceHead(void) {
+    while (R.head < R.numsent) {
+        struct sentMsg *m = R.sent + R.head % MATCH_WINDOW;
+        if (m->state == MSG_PENDING) break;
+        free(m->text);
+        m->text = NULL;
+        R.head++;
+    }
+}
+
+/* Mark a pending message as lost. */
+void loseMessage(struct sentMsg *m) {
+    m->state = MSG_LOST;
+    R.lost++;
+}
+
+/* The current line of the connection 'c' is complete from the point of
+ * view of the server: remember the message the server will broadcast for
+ * it, unless the line is a command. */
+void expectMessage(struct replayConn *c, long long now) {
+    /* Like the server, we stop at the first \r (or null byte). */
+    c->line[c->linelen] = 0;
+    int len = strcspn(c->line,"\r");
+    int command = c->line[0] == '/';
+    c->linelen = 0;
+    if (command) return;
+
+    /* Make room for the new message, giving up on the oldest one if it
+     * is still pending after all this time. */
+    if (R.numsent - R.head == MATCH_WINDOW) {
+        loseMessage(R.sent + R.head % MATCH_WINDOW);
+        advanceHead();
+    }
+
+    struct sentMsg *m = R.sent + R.numsent % MATCH_WINDOW;
+    m->time = now;
+    m->state = MSG_PENDING;
+    m->text = chatMalloc(len);
+    memcpy(m->text,c->line,len);
+    m->len = len;
+    R.numsent++;
+}
+
+/* Track the lines in the data sent by the connection 'c', splitting them
+ * the same way the server does. */
+void trackSentLines(struct replayConn *c, char *p, size_t len, long long now) {
+    if (c->line == NULL) c->line = chatMalloc(SERVER_LINE_MAX+1);
+    for (size_t j = 0; j < len; j++) {
+        if (p[j] == '\n') {
+            expectMessage(c,now);
+            continue;
+        }
+        c->line[c->linelen++] = p[j];
+        if (c->linelen == SERVER_LINE_MAX) expectMessage(c,now);
+    }
+}
+
+/* Return true if the line 'l' of 'len' bytes received by the probe (newline
+ * excluded) is the broadcast of the message 'm'. The line is in the form
+ * "nick> text", possibly truncated by the server if too long. Since we
+ * don't know the nick, the text is compared with what follows the "> "
+ * separator. */
+int probeLineMatches(char *l, int len, struct sentMsg *m) {
+    /* Common case: the line was not truncated. */
+    int i = len - m->len;
+    if (i >= 2 && !memcmp(l+i-2,"> ",2) && !memcmp(l+i,m->text,m->len))
+        return 1;
+    if (len != SERVER_MSG_MAX-1) return 0;
+
+    /* The line was truncated: the part of the text received is a prefix
+     * of the message, but we don't know where the nick ends. */
+    for (i = 2; i < len; i++) {
+        if (memcmp(l+i-2,"> ",2)) continue;
+        if (len-i < m->len && !memcmp(l+i,m->text,len-i)) return 1;
+    }
+    return 0;
+}
+
+/* Handle a complete line received by the probe, matching it with the oldest
+ * pending message having the same text. */
+void processProbeLine(char *l, int len, long long now) {
+    R.received++;
+    for (long long k = R.head; k < R.numsent; k++) {
+        struct sentMsg *m = R.sent + k % MATCH_WINDOW;
+        if (m->state != MSG_PENDING || !probeLineMatches(l,len,m)) continue;
+
+        m->state = MSG_MATCHED;
+        if (R.matched == R.latencies_size) {
+            R.latencies_size = R.latencies_size ? R.latencies_size*2 : 4096;
+            R.latencies = chatRealloc(R.latencies,
+                                      sizeof(long long)*R.latencies_size);
+        }
+        R.latencies[R.matched++] = now - m->time;
+        advanceHead();
+        return;
+    }
+    R.unexpected++;
+}
+
+/* Execute a single capture record. */
+void replayRecord(struct captureRecord *r) {
+    struct replayConn *c = getConn(r->conn);
+
+    R.records++;
+    if (r->type == CAPTURE_CONNECT) {
+        if (c->fd != -1) close(c->fd);
+        c->fd = TCPConnect(R.host,R.port,0);
+        if (c->fd == -1) {
+            perror("Connecting to server");
+            exit(1);
+        }
+        socketSetNonBlockNoDelay(c->fd);
+        c->linelen = 0;
+        R.connections++;
+        R.pollfds_dirty = 1;
+    } else if (r->type == CAPTURE_DATA) {
+        if (c->fd == -1) return; // Connected before the capture started.
+        char *p = r->data;
+        size_t left = r->len;
+        trackSentLines(c,p,left,ustime());
+        while (left) {
+            ssize_t nwritten = write(c->fd,p,left);
+            if (nwritten == -1) {
+                if (errno == EAGAIN) {
+                    struct pollfd pfd = {c->fd, POLLOUT, 0};
+                    poll(&pfd,1,-1);
+                    continue;
+                }
+                perror("Writing to server");
+                exit(1);
+            }
+            p += nwritten;
+            left -= nwritten;
+        }
+        R.bytes_sent += r->len;
+    } else if (r->type == CAPTURE_CLOSE) {
+        if (c->fd == -1) return;
+        close(c->fd);
+        c->fd = -1;
+        free(c->line);
+        c->line = NULL;
+        c->linelen = 0;
+        R.pollfds_dirty = 1;
+    }
+}
+
+/* Read what the probe received, and process every complete line. */
+void readProbe(void) {
+    char buf[4096];
+    long long now = ustime();
+    ssize_t nread;
+
+    while ((nread = read(R.probe,buf,sizeof(buf))) > 0) {
+        R.bytes_received += nread;
+        for (ssize_t j = 0; j < nread; j++) {
+            if (buf[j] != '\n') {
+                /* Lines are never longer than SERVER_MSG_MAX, but
+                 * better to be safe. */
+                if (R.probe_linelen < SERVER_MSG_MAX)
+                    R.probe_line[R.probe_linelen++] = buf[j];
+                continue;
+            }
+            if (!R.probe_welcomed)
+                R.probe_welcomed = 1; // Skip the welcome message.
+            else
+                processProbeLine(R.probe_line,R.probe_linelen,now);
+            R.probe_linelen = 0;
+        }
+    }
+    if (nread == 0) {
+        fprintf(stderr,"Probe connection closed by server\n");
+        exit(1);
+    }
+}
+
+/* Wait up to 'timeout' milliseconds for input from the server, and consume
+ * it: the probe input is used to measure the latency, the input of the
+ * replayed connections is just discarded. */
+void drainInput(int timeout) {
+    if (R.pollfds_dirty) rebuildPollfds();
+    int retval = poll(R.pollfds,R.numpollfds,timeout);
+    if (retval <= 0) return;
+
+    for (int j = 0; j < R.numpollfds; j++) {
+        if (R.pollfds[j].revents == 0) continue;
+        if (R.pollfds[j].fd == R.probe) {
+            readProbe();
+            continue;
+        }
+        char buf[4096];
+        ssize_t nread;
+        while ((nread = read(R.pollfds[j].fd,buf,sizeof(buf))) > 0)
+            R.bytes_received += nread;
+    }
+}
+
+/* Wait till the time 'due' (as returned by ustime()) consuming the input
+ * from the server meanwhile. poll(2) timeout resolution is one millisecond,
+ * so the last sub-millisecond part is waited with nanosleep(2): spinning
+ * would burn a CPU, competing with the server we are measuring. */
+void waitUntil(long long due) {
+    long long now;
+    while ((now = ustime()) < due) {
+        long long left = due-now;
+        if (left >= 1000) {
+            drainInput(left/1000);
+        } else {
+            struct timespec ts = {0, left*1000};
+            drainInput(0);
+            nanosleep(&ts,NULL);
+        }
+    }
+}
+
+void printReport(long long elapsed) {
+    double secs = (double)elapsed/1000000;
+
+    printf("speed: ");
+    if (R.speed == 0) printf("max\n"); else printf("%gx\n", R.speed);
+    printf("records: %lld\n", R.records);
+    printf("connections: %lld\n", R.connections);
+    printf("duration_sec: %.3f\n", secs);
+    printf("bytes_sent: %lld\n", R.bytes_sent);
+    printf("bytes_received: %lld\n", R.bytes_received);
+    printf("messages_sent: %lld\n", R.numsent);
+    printf("messages_received: %lld\n", R.received);
+    printf("messages_matched: %lld\n", R.matched);
+    printf("messages_lost: %lld\n", R.lost);
+    printf("messages_unexpected: %lld\n", R.unexpected);
+    printf("throughput_msg_per_sec: %.1f\n", secs ? R.numsent/secs : 0);
+    printf("throughput_bytes_per_sec: %.1f\n", secs ? R.bytes_sent/secs : 0);
+    printLatencyStats(R.latencies,R.matched);
+}
+
+void usage(char *progname) {
+    fprintf(stderr,
+        "Usage: %s <capture-file> [--host <host>] [--port <port>]\n"
+        "          [--speed <multiplier> | --max]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) usage(argv[0]);
+    R.host = "127.0.0.1";
+    R.port = 7711;
+    R.speed = 1;
+
+    for (int j = 2; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--host") && moreargs) {
+            R.host = argv[++j];
+        } else if (!strcmp(argv[j],"--port") && moreargs) {
+            R.port = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--speed") && moreargs) {
+            R.speed = strtod(argv[++j],NULL);
+            if (R.speed <= 0) usage(argv[0]);
+        } else if (!strcmp(argv[j],"--max")) {
+            R.speed = 0;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    FILE *fp = fopen(argv[1],"r");
+    if (fp == NULL) {
+        perror("Opening capture file");
+        exit(1);
+    }
+    char magic[sizeof(CAPTURE_MAGIC)-1];
+    if (fread(magic,sizeof(magic),1,fp) != 1 ||
+        memcmp(magic,CAPTURE_MAGIC,sizeof(magic)))
+    {
+        fprintf(stderr,"%s is not a smallchat capture file\n", argv[1]);
+        exit(1);
+    }
+
+    /* The capture may contain many concurrent connections. */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE,&rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE,&rl);
+    }
+
+    R.probe = TCPConnect(R.host,R.port,0);
+    if (R.probe == -1) {
+        perror("Connecting to server");
+        exit(1);
+    }
+    socketSetNonBlockNoDelay(R.probe);
+    R.pollfds_dirty = 1;
+    while (!R.probe_welcomed) drainInput(-1);
+
+    /* Replay the records. Every record is scheduled at its capture time
+     * divided by the speed multiplier, relative to the replay start. */
+    struct captureRecord r = {0};
+    long long start = ustime(), capture_time = 0;
+    int retval;
+
+    while ((retval = captureReadRecord(fp,&r)) == 1) {
+        capture_time += r.delta;
+        if (R.speed == 0) {
+            if (R.records % DRAIN_EVERY == 0) drainInput(0);
+        } else {
+            waitUntil(start + (long long)(capture_time/R.speed));
+        }
+        replayRecord(&r);
+    }
+    if (retval == -1)
+        fprintf(stderr,"Capture file truncated or corrupted, "
+                       "replayed the first %lld records\n", R.records);
+    fclose(fp);
+    free(r.data);
+
+    /* Wait for the probe to receive the last messages, but not forever,
+     * since the server may have dropped some. */
+    long long last = ustime(), end = last;
+    while (R.head < R.numsent && ustime()-last < FINAL_WAIT_US) {
+        long long matched = R.matched;
+        drainInput(100);
+        if (R.matched != matched) end = last = ustime();
+    }
+
+    /* What is still pending at this point will never arrive. */
+    for (long long k = R.head; k < R.numsent; k++) {
+        struct sentMsg *m = R.sent + k % MATCH_WINDOW;
+        if (m->state == MSG_PENDING) loseMessage(m);
+    }
+    printReport(end-start);
+    return 0;
+}
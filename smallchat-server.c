@@ -28,43 +28,166 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE // For sched_setaffinity() and the CPU_* macros.
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <sys/select.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "chatlib.h"
 
 /* ============================ Data structures =================================
  * The minimal stuff we can afford to have. This example must be simple
  * even for people that don't know a lot of C.
+ *
+ * Most clients of a chat are idle most of the time, so the per-client state
+ * is kept as small as possible: clients live in a dense array (no holes to
+ * skip, no table sized after the highest file descriptor), short nicks are
+ * stored inside the client structure itself, and I/O buffers are borrowed
+ * from a shared pool only while there is some data in flight.
  * =========================================================================== */
 
-#define MAX_CLIENTS 1000 // This is actually the higher file descriptor.
 #define SERVER_PORT 7711
+#define NICK_INLINE_LEN 20  // Nicks shorter than that are stored inline.
+#define IOBUF_LEN 512       // Size of the buffers in the shared pool.
+#define IOBUF_POOL_MAX 128  // Max free buffers we keep around for reuse.
+#define ACCEPT_MAX_PER_CALL 1000 // Max clients accepted per event loop cycle.
+#define CAPTURE_FLUSH_US 1000000 // Flush the capture file at least this often.
+
+/* An I/O buffer. Clients don't own buffers: they take one from the pool
+ * when a read returns a partial line or a write can't be fully transferred
+ * to the kernel, and give it back as soon as the buffer is empty again. */
+struct iobuf {
+    struct iobuf *next; // Next free buffer, when the buffer is in the pool.
+    int len;            // Bytes of valid data in 'buf'.
+    char buf[IOBUF_LEN];
+};
 
 /* This structure represents a connected client. There is very little
- * info about it: the socket descriptor and the nick name, if set, otherwise
- * the first byte of the nickname is set to 0 if not set.
- * The client can set its nickname with /nick <nickname> command. */
+ * info about it: the socket descriptor, the nick name, and the read/write
+ * buffers, that are NULL unless there is I/O in progress.
+ * The client can set its nickname with /nick <nickname> command.
+ *
+ * The nick is stored in the 'nick' array when it fits, otherwise it is
+ * allocated on the heap and referenced by 'longnick'. Use clientNick()
+ * to get the nick of a client without caring about where it lives. */
 struct client {
-    int fd;     // Client socket.
-    char *nick; // Nickname of the client.
+    int fd;                      // Client socket.
+    char nick[NICK_INLINE_LEN];  // Nickname of the client, if short.
+    char *longnick;              // Nickname of the client, if long, or NULL.
+    struct iobuf *rbuf;          // Partial line read so far, or NULL.
+    struct iobuf *wbuf;          // Data not yet written to socket, or NULL.
 };
 
-/* This global structure encapsulates the global state of the chat. */
+/* This global structure encapsulates the global state of the chat.
+ *
+ * Clients are referenced by their index in the 'clients' array. The array
+ * is always dense: when a client is freed, the last client is moved into
+ * its slot. The 'pollfds' array is kept parallel to it, so that the poll(2)
+ * entry of clients[j] is pollfds[j+1] (the first entry is used for the
+ * listening socket). */
 struct chatState {
     int serversock;     // Listening server socket.
     int numclients;     // Number of connected clients right now.
-    int maxclient;      // The greatest 'clients' slot populated.
-    struct client *clients[MAX_CLIENTS]; // Clients are set in the corresponding
-                                         // slot of their socket descriptor.
+    int allocated;      // Number of slots allocated in 'clients'.
+    struct client *clients;  // Connected clients, 'numclients' entries.
+    struct pollfd *pollfds;  // 'numclients'+1 entries, see above.
+    struct iobuf *freebufs;  // Pool of free I/O buffers (linked list).
+    int numfreebufs;         // Number of buffers in the pool.
+    FILE *capture;           // Traffic capture file, or NULL.
+    long long capture_last;  // Time of the last capture record, in us.
+    long long capture_flush; // Time the capture file was last flushed.
+    int busypoll_us;         // Low latency mode spin budget, 0 = disabled.
 };
 
 struct chatState *Chat; // Initialized at startup.
 
+/* ============================== Buffers pool ================================
+ * A trivial free list. Buffers are allocated on demand, and when released
+ * we retain up to IOBUF_POOL_MAX of them, so that the memory used for
+ * buffers is proportional to the number of clients doing I/O right now, and
+ * not to the number of connected clients.
+ * =========================================================================== */
+
+/* Take an empty buffer from the pool, allocating a new one if needed. */
+struct iobuf *getIOBuffer(void) {
+    struct iobuf *b = Chat->freebufs;
+    if (b) {
+        Chat->freebufs = b->next;
+        Chat->numfreebufs--;
+    } else {
+        b = chatMalloc(sizeof(*b));
+    }
+    b->next = NULL;
+    b->len = 0;
+    return b;
+}
+
+/* Return a buffer to the pool. */
+void releaseIOBuffer(struct iobuf *b) {
+    if (Chat->numfreebufs >= IOBUF_POOL_MAX) {
+        free(b);
+        return;
+    }
+    b->next = Chat->freebufs;
+    Chat->freebufs = b;
+    Chat->numfreebufs++;
+}
+
+/* ============================= Traffic capture ================================
+ * When the server is started with --capture <file>, everything the clients
+ * send is recorded, with timestamps, so that the traffic can be replayed
+ * against the server with smallchat-replay. See chatlib.c for the format.
+ * =========================================================================== */
+
+/* Open the capture file and write the file header. */
+void openCapture(char *filename) {
+    Chat->capture = fopen(filename,"w");
+    if (Chat->capture == NULL) {
+        perror("Opening capture file");
+        exit(1);
+    }
+    fwrite(CAPTURE_MAGIC,strlen(CAPTURE_MAGIC),1,Chat->capture);
+    Chat->capture_last = Chat->capture_flush = ustime();
+}
+
+/* Record an event in the capture file, if the capture is enabled. */
+void captureEvent(int type, int fd, const char *data, size_t len) {
+    if (Chat->capture == NULL) return;
+    long long now = ustime();
+    if (captureWriteRecord(Chat->capture,type,now-Chat->capture_last,
+                           fd,data,len) == -1)
+    {
+        /* Better to stop capturing than to produce a file that can't be
+         * replayed because of missing records. */
+        perror("Writing capture file, capture stopped");
+        fclose(Chat->capture);
+        Chat->capture = NULL;
+        return;
+    }
+    Chat->capture_last = now;
+}
+
+/* The capture file is written with buffered stdio calls: from time to time
+ * make sure the buffered data reaches the file, so that a server killed
+ * while capturing loses at most the last CAPTURE_FLUSH_US of traffic. */
+void flushCapture(void) {
+    if (Chat->capture == NULL) return;
+    long long now = ustime();
+    if (now - Chat->capture_flush < CAPTURE_FLUSH_US) return;
+    fflush(Chat->capture);
+    Chat->capture_flush = now;
+}
+
 /* ====================== Small chat core implementation ========================
  * Here the idea is very simple: we accept new connections, read what clients
  * write us and fan-out (that is, send-to-all) the message to everybody
@@ -72,44 +195,134 @@ struct chatState *Chat; // Initialized at startup.
  * simple chat system ever possible.
  * =========================================================================== */
 
+/* Return the nick of the client. */
+char *clientNick(struct client *c) {
+    return c->longnick ? c->longnick : c->nick;
+}
+
+/* Set the nick of the client to the null terminated string 'nick'. */
+void setClientNick(struct client *c, char *nick) {
+    size_t nicklen = strlen(nick);
+    free(c->longnick);
+    c->longnick = NULL;
+    if (nicklen < sizeof(c->nick)) {
+        memcpy(c->nick,nick,nicklen+1);
+    } else {
+        c->longnick = chatMalloc(nicklen+1);
+        memcpy(c->longnick,nick,nicklen+1);
+    }
+}
+
 /* Create a new client bound to 'fd'. This is called when a new client
- * connects. As a side effect updates the global Chat state. */
-struct client *createClient(int fd) {
+ * connects. As a side effect updates the global Chat state. The index
+ * of the new client in Chat->clients is returned. */
+int createClient(int fd) {
     char nick[32]; // Used to create an initial nick for the user.
-    int nicklen = snprintf(nick,sizeof(nick),"user:%d",fd);
-    struct client *c = chatMalloc(sizeof(*c));
+    snprintf(nick,sizeof(nick),"user:%d",fd);
     socketSetNonBlockNoDelay(fd); // Pretend this will not fail.
+
+    /* Make room for the new client if needed. Both arrays grow
+     * together, doubling their size. */
+    if (Chat->numclients == Chat->allocated) {
+        Chat->allocated = Chat->allocated ? Chat->allocated*2 : 64;
+        Chat->clients = chatRealloc(Chat->clients,
+            sizeof(struct client)*Chat->allocated);
+        Chat->pollfds = chatRealloc(Chat->pollfds,
+            sizeof(struct pollfd)*(Chat->allocated+1));
+    }
+
+    /* In low latency mode, enable busy polling for the client socket as
+     * well. If it fails, it will fail for every client: warn just once. */
+    static int busypoll_warned = 0;
+    if (Chat->busypoll_us && socketSetBusyPoll(fd,Chat->busypoll_us) == -1 &&
+        !busypoll_warned)
+    {
+        perror("Warning: setting SO_BUSY_POLL for clients (ignored)");
+        busypoll_warned = 1;
+    }
+
+    int id = Chat->numclients++;
+    struct client *c = Chat->clients+id;
+    memset(c,0,sizeof(*c));
     c->fd = fd;
-    c->nick = chatMalloc(nicklen+1);
-    memcpy(c->nick,nick,nicklen);
-    assert(Chat->clients[c->fd] == NULL); // This should be available.
-    Chat->clients[c->fd] = c;
-    /* We need to update the max client set if needed. */
-    if (c->fd > Chat->maxclient) Chat->maxclient = c->fd;
-    Chat->numclients++;
-    return c;
+    setClientNick(c,nick);
+    Chat->pollfds[id+1].fd = fd;
+    Chat->pollfds[id+1].events = POLLIN;
+    Chat->pollfds[id+1].revents = 0;
+    captureEvent(CAPTURE_CONNECT,fd,NULL,0);
+    return id;
 }
 
-/* Free a client, associated resources, and unbind it from the global
- * state in Chat. */
-void freeClient(struct client *c) {
-    free(c->nick);
+/* Free the client with the specified index, associated resources, and
+ * unbind it from the global state in Chat. Note that the last client in
+ * the array is moved into the freed slot, so after this call the index
+ * 'id' refers to a different client (or to none, if it was the last). */
+void freeClient(int id) {
+    struct client *c = Chat->clients+id;
+    free(c->longnick);
+    if (c->rbuf) releaseIOBuffer(c->rbuf);
+    if (c->wbuf) releaseIOBuffer(c->wbuf);
+    captureEvent(CAPTURE_CLOSE,c->fd,NULL,0);
     close(c->fd);
-    Chat->clients[c->fd] = NULL;
-    Chat->numclients--;
-    if (Chat->maxclient == c->fd) {
-        /* Ooops, this was the max client set. Let's find what is
-         * the new highest slot used. */
-        int j;
-        for (j = Chat->maxclient-1; j >= 0; j--) {
-            if (Chat->clients[j] != NULL) {
-                Chat->maxclient = j;
-                break;
-            }
+
+    int last = --Chat->numclients;
+    if (id != last) {
+        Chat->clients[id] = Chat->clients[last];
+        Chat->pollfds[id+1] = Chat->pollfds[last+1];
+    }
+}
+
+/* Write the message 's' of 'len' bytes to the client. If the kernel socket
+ * buffer can't take everything, the remaining data is retained in a buffer
+ * from the pool and transferred later, when the socket is writable again.
+ * A client not consuming its data fast enough will just miss the messages
+ * not fitting in its buffer: we prefer to lose messages for a slow client
+ * than to use unbounded memory.
+ *
+ * Messages are either sent whole or dropped whole, so that a slow client
+ * never receives half a line. This is why messages can't be longer than
+ * IOBUF_LEN: the remaining part of a partial write always fits in an empty
+ * buffer. */
+void writeToClient(int id, char *s, size_t len) {
+    struct client *c = Chat->clients+id;
+
+    assert(len <= IOBUF_LEN);
+
+    /* If there is already pending data, we can't write directly, or the
+     * order of the messages would not be preserved. Either the whole
+     * message fits in the buffer, or we drop it. */
+    if (c->wbuf) {
+        if (len > (size_t)(IOBUF_LEN - c->wbuf->len)) return; // Drop it.
+    } else {
+        ssize_t nwritten = write(c->fd,s,len);
+        if (nwritten == -1) {
+            if (errno != EAGAIN) return; // Read handler will free it.
+            nwritten = 0;
         }
-        if (j == -1) Chat->maxclient = -1; // We no longer have clients.
+        if ((size_t)nwritten == len) return;
+        s += nwritten;
+        len -= nwritten;
+        c->wbuf = getIOBuffer();
+        Chat->pollfds[id+1].events |= POLLOUT;
+    }
+    memcpy(c->wbuf->buf+c->wbuf->len,s,len);
+    c->wbuf->len += len;
+}
+
+/* Called when the socket of a client with pending output is writable.
+ * Once all the data is transferred, the buffer is returned to the pool. */
+void flushClientOutput(int id) {
+    struct client *c = Chat->clients+id;
+    ssize_t nwritten = write(c->fd,c->wbuf->buf,c->wbuf->len);
+    if (nwritten <= 0) return; // Try again later, or the read will fail.
+    c->wbuf->len -= nwritten;
+    if (c->wbuf->len) {
+        memmove(c->wbuf->buf,c->wbuf->buf+nwritten,c->wbuf->len);
+        return;
     }
-    free(c);
+    releaseIOBuffer(c->wbuf);
+    c->wbuf = NULL;
+    Chat->pollfds[id+1].events &= ~POLLOUT;
 }
 
 /* Allocate and init the global stuff. */
@@ -117,155 +330,320 @@ void initChat(void) {
     Chat = chatMalloc(sizeof(*Chat));
     memset(Chat,0,sizeof(*Chat));
     /* No clients at startup, of course. */
-    Chat->maxclient = -1;
     Chat->numclients = 0;
 
+    /* Writing to a client that closed the connection should not kill the
+     * server: we'll notice the client is gone when reading from it. */
+    signal(SIGPIPE,SIG_IGN);
+
+    /* Every client is a file descriptor: try to raise the limit of open
+     * files to the hard limit so that we can serve as many clients as
+     * the system allows. This is best effort. */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE,&rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE,&rl);
+    }
+
     /* Create our listening socket, bound to the given port. This
-     * is where our clients will connect. */
+     * is where our clients will connect. The socket is non blocking
+     * so that we can accept all the pending clients in a loop. */
     Chat->serversock = createTCPServer(SERVER_PORT);
     if (Chat->serversock == -1) {
         perror("Creating listening socket");
         exit(1);
     }
+    socketSetNonBlockNoDelay(Chat->serversock);
+
+    /* Make room for the listening socket poll(2) entry. */
+    Chat->pollfds = chatMalloc(sizeof(struct pollfd));
+    Chat->pollfds[0].fd = Chat->serversock;
+    Chat->pollfds[0].events = POLLIN;
+}
+
+/* ============================= Low latency mode ===============================
+ * When started with --busy-poll <usec>, the server tries hard to reduce the
+ * latency of every hop: instead of sleeping in poll(2) until the kernel
+ * wakes us up, it polls without blocking for up to 'usec' microseconds, and
+ * only then blocks as usual. The SO_BUSY_POLL option is also set for the
+ * listening socket and every client socket, so that the kernel can busy
+ * poll the network device too (when the driver supports it), and the server
+ * can be pinned to a given CPU with --cpu <id>, so that it is never
+ * migrated and its cache stays warm. The price is CPU time: every event loop
+ * iteration that finds nothing to do spins for up to 'usec' microseconds
+ * before blocking, so a busy server spins between every burst of events,
+ * while an idle server only spins once per poll(2) timeout (every second).
+ * =========================================================================== */
+
+/* Enable the low latency mode, with a spin budget of 'usec' microseconds. */
+void enableBusyPoll(int usec) {
+    Chat->busypoll_us = usec;
+    if (socketSetBusyPoll(Chat->serversock,usec) == -1)
+        perror("Warning: setting SO_BUSY_POLL (ignored)");
+}
+
+/* Pin the process to the specified CPU. */
+void pinToCPU(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    if (sched_setaffinity(0,sizeof(set),&set) == -1) {
+        perror("Pinning to CPU");
+        exit(1);
+    }
+#else
+    (void)cpu;
+    fprintf(stderr,"CPU pinning is only supported on Linux\n");
+    exit(1);
+#endif
+}
+
+/* Wait for events with poll(2), blocking for at most 'timeout' milliseconds.
+ * In low latency mode, spin polling without blocking for up to the
+ * configured budget before blocking. */
+int waitForEvents(int timeout) {
+    int nfds = Chat->numclients+1;
+    if (Chat->busypoll_us) {
+        long long start = ustime();
+        do {
+            int retval = poll(Chat->pollfds,nfds,0);
+            if (retval != 0) return retval;
+        } while (ustime()-start < Chat->busypoll_us);
+    }
+    return poll(Chat->pollfds,nfds,timeout);
 }
 
 /* Send the specified string to all connected clients but the one
  * having as socket descriptor 'excluded'. If you want to send something
  * to every client just set excluded to an impossible socket: -1. */
 void sendMsgToAllClientsBut(int excluded, char *s, size_t len) {
-    for (int j = 0; j <= Chat->maxclient; j++) {
-        if (Chat->clients[j] == NULL ||
-            Chat->clients[j]->fd == excluded) continue;
-
-        /* Important: we don't do ANY BUFFERING. We just use the kernel
-         * socket buffers. If the content does not fit, we don't care.
-         * This is needed in order to keep this program simple. */
-        write(Chat->clients[j]->fd,s,len);
+    for (int j = 0; j < Chat->numclients; j++) {
+        if (Chat->clients[j].fd == excluded) continue;
+        writeToClient(j,s,len);
     }
 }
 
+/* Process a single line (without the trailing newline) sent by the client
+ * with the specified index. */
+void processClientLine(int id, char *line) {
+    struct client *c = Chat->clients+id;
+
+    /* Remove any trailing carriage return (telnet sends \r\n). */
+    char *p = strchr(line,'\r'); if (p) *p = 0;
+
+    /* If the user message starts with "/", we
+     * process it as a client command. So far
+     * only the /nick <newnick> command is implemented. */
+    if (line[0] == '/') {
+        /* Check for an argument of the command, after
+         * the space. */
+        char *arg = strchr(line,' ');
+        if (arg) {
+            *arg = 0; /* Terminate command name. */
+            arg++; /* Argument is 1 byte after the space. */
+        }
+
+        if (!strcmp(line,"/nick") && arg) {
+            setClientNick(c,arg);
+        } else {
+            /* Unsupported command. Send an error. */
+            char *errmsg = "Unsupported command\n";
+            writeToClient(id,errmsg,strlen(errmsg));
+        }
+    } else {
+        /* Create a message to send everybody (and show
+         * on the server console) in the form:
+         *   nick> some message. */
+        char msg[IOBUF_LEN+1]; // Max message length plus null term.
+        int msglen = snprintf(msg, sizeof(msg),
+            "%s> %s\n", clientNick(c), line);
+
+        /* snprintf() return value may be larger than
+         * sizeof(msg) in case there is no room for the
+         * whole output. In such case we truncate the message
+         * to IOBUF_LEN (see writeToClient()), but still want it
+         * to be terminated by a newline. */
+        if (msglen > IOBUF_LEN) {
+            msglen = IOBUF_LEN;
+            msg[msglen-1] = '\n';
+        }
+        printf("%s",msg);
+
+        /* Send it to all the other clients. */
+        sendMsgToAllClientsBut(c->fd,msg,msglen);
+    }
+}
+
+/* Read the data the client sent us, and process every complete line.
+ * A partial line is retained in the client read buffer until the rest
+ * arrives. Returns -1 if the connection was closed or on error, in which
+ * case the caller should free the client, otherwise 0. */
+int readFromClient(int id) {
+    struct client *c = Chat->clients+id;
+    struct iobuf *b = c->rbuf ? c->rbuf : getIOBuffer();
+
+    /* Leave one byte for the null term, so we can treat the last line
+     * as a C string even when the buffer is full. */
+    int nread = read(c->fd,b->buf+b->len,IOBUF_LEN-1-b->len);
+    if (nread <= 0) {
+        if (nread == -1 && errno == EAGAIN) nread = 0;
+        else {
+            if (b != c->rbuf) releaseIOBuffer(b);
+            return -1;
+        }
+    }
+    if (nread) captureEvent(CAPTURE_DATA,c->fd,b->buf+b->len,nread);
+    b->len += nread;
+
+    /* Process every full line. If the buffer is full and there is no
+     * newline at all, the line is too long: process it as it is. */
+    char *start = b->buf, *end = b->buf+b->len, *nl;
+    while ((nl = memchr(start,'\n',end-start)) != NULL ||
+           (start == b->buf && b->len == IOBUF_LEN-1))
+    {
+        if (nl == NULL) nl = end;
+        *nl = 0;
+        processClientLine(id,start);
+        /* processClientLine() never frees or moves clients, so 'c' is
+         * still valid here. */
+        start = nl+1;
+        if (start > end) start = end;
+    }
+
+    /* Retain the partial line, if any. Otherwise the client is idle
+     * again, and the buffer goes back to the pool. */
+    b->len = end-start;
+    if (b->len) {
+        memmove(b->buf,start,b->len);
+        c->rbuf = b;
+    } else {
+        releaseIOBuffer(b);
+        c->rbuf = NULL;
+    }
+    return 0;
+}
+
 /* The main() function implements the main chat logic:
  * 1. Accept new clients connections if any.
  * 2. Check if any client sent us some new message.
  * 3. Send the message to all the other clients. */
-int main(void) {
-    initChat();
+void usage(char *progname) {
+    fprintf(stderr,"Usage: %s [--capture <file>] "
+                   "[--busy-poll <usec>] [--cpu <id>]\n", progname);
+    exit(1);
+}
 
-    while(1) {
-        fd_set readfds;
-        struct timeval tv;
-        int retval;
+/* Parse 's' as a decimal integer in the range min..INT_MAX. Returns the
+ * number, or -1 if the string is not a valid number or is out of range:
+ * options like --busy-poll should not be silently ignored because of a
+ * typo. */
+int parseIntOption(char *s, int min) {
+    char *end;
+    errno = 0;
+    long v = strtol(s,&end,10);
+    if (errno || end == s || *end != '\0' || v < min || v > INT_MAX)
+        return -1;
+    return v;
+}
 
-        FD_ZERO(&readfds);
-        /* When we want to be notified by select() that there is
-         * activity? If the listening socket has pending clients to accept
-         * or if any other client wrote anything. */
-        FD_SET(Chat->serversock, &readfds);
+int main(int argc, char **argv) {
+    char *capture_file = NULL;
+    int busypoll_us = 0, cpu = -1;
 
-        for (int j = 0; j <= Chat->maxclient; j++) {
-            if (Chat->clients[j]) FD_SET(j, &readfds);
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--capture") && moreargs) {
+            capture_file = argv[++j];
+        } else if (!strcmp(argv[j],"--busy-poll") && moreargs) {
+            busypoll_us = parseIntOption(argv[++j],1);
+            if (busypoll_us == -1) usage(argv[0]);
+        } else if (!strcmp(argv[j],"--cpu") && moreargs) {
+            cpu = parseIntOption(argv[++j],0);
+            if (cpu == -1) usage(argv[0]);
+        } else {
+            usage(argv[0]);
         }
+    }
+
+    if (cpu != -1) pinToCPU(cpu);
+    initChat();
+    if (capture_file) openCapture(capture_file);
+    if (busypoll_us) enableBusyPoll(busypoll_us);
+
+    while(1) {
+        int retval;
 
-        /* Set a timeout for select(), see later why this may be useful
+        /* We use poll(2) instead of select(2): select() is limited to
+         * file descriptors lower than FD_SETSIZE (usually 1024), and requires
+         * to rebuild the set at every iteration. The pollfds array is
+         * instead maintained while clients are created and freed, and
+         * tells poll(2) what we want to be notified for: new clients to
+         * accept in the listening socket, data to read from the clients,
+         * and, for clients with pending output, when they are writable.
+         * See waitForEvents() for the low latency mode.
+         *
+         * Note that poll(2) is still O(N) in the number of clients: at
+         * every call the whole array is copied to the kernel, that checks
+         * every socket, and then we scan all the 'revents' fields. So while
+         * the memory we use for an idle client is small, every idle client
+         * still costs CPU time for every message. Serving a very large
+         * number of clients with low latency would require an API like
+         * epoll(7) or kqueue(2), where the cost of a call is proportional
+         * to the number of sockets with events. Also note that sending a
+         * message to everybody is O(N) anyway, whatever the API is.
+         *
+         * Set a timeout for poll(), see later why this may be useful
          * in the future (not now). */
-        tv.tv_sec = 1; // 1 sec timeout
-        tv.tv_usec = 0;
-
-        /* Select wants as first argument the maximum file descriptor
-         * in use plus one. It can be either one of our clients or the
-         * server socket itself. */
-        int maxfd = Chat->maxclient;
-        if (maxfd < Chat->serversock) maxfd = Chat->serversock;
-        retval = select(maxfd+1, &readfds, NULL, NULL, &tv);
+        retval = waitForEvents(1000);
         if (retval == -1) {
-            perror("select() error");
+            if (errno == EINTR) continue;
+            perror("poll() error");
             exit(1);
         } else if (retval) {
 
-            /* If the listening socket is "readable", it actually means
-             * there are new clients connections pending to accept. */
-            if (FD_ISSET(Chat->serversock, &readfds)) {
-                int fd = acceptClient(Chat->serversock);
-                struct client *c = createClient(fd);
-                /* Send a welcome message. */
-                char *welcome_msg =
-                    "Welcome to Simple Chat! "
-                    "Use /nick <nick> to set your nick.\n";
-                write(c->fd,welcome_msg,strlen(welcome_msg));
-                printf("Connected client fd=%d\n", fd);
+            /* Here for each connected client, check if there are pending
+             * data the client sent us, or if we can write the pending
+             * output. We scan the clients from the last, so that when
+             * a client is freed, the one moved into its slot (the last)
+             * was already processed. */
+            for (int j = Chat->numclients-1; j >= 0; j--) {
+                short revents = Chat->pollfds[j+1].revents;
+                if (revents == 0) continue;
+                if (revents & POLLOUT && Chat->clients[j].wbuf)
+                    flushClientOutput(j);
+                if (revents & (POLLIN|POLLERR|POLLHUP) &&
+                    readFromClient(j) == -1)
+                {
+                    /* Error or short read means that the socket
+                     * was closed. */
+                    printf("Disconnected client fd=%d, nick=%s\n",
+                        Chat->clients[j].fd, clientNick(Chat->clients+j));
+                    freeClient(j);
+                }
             }
 
-            /* Here for each connected client, check if there are pending
-             * data the client sent us. */
-            char readbuf[256];
-            for (int j = 0; j <= Chat->maxclient; j++) {
-                if (Chat->clients[j] == NULL) continue;
-                if (FD_ISSET(j, &readfds)) {
-                    /* Here we just hope that there is a well formed
-                     * message waiting for us. But it is entirely possible
-                     * that we read just half a message. In a normal program
-                     * that is not designed to be that simple, we should try
-                     * to buffer reads until the end-of-the-line is reached. */
-                    int nread = read(j,readbuf,sizeof(readbuf)-1);
-
-                    if (nread <= 0) {
-                        /* Error or short read means that the socket
-                         * was closed. */
-                        printf("Disconnected client fd=%d, nick=%s\n",
-                            j, Chat->clients[j]->nick);
-                        freeClient(Chat->clients[j]);
-                    } else {
-                        /* The client sent us a message. We need to
-                         * relay this message to all the other clients
-                         * in the chat. */
-                        struct client *c = Chat->clients[j];
-                        readbuf[nread] = 0;
-
-                        /* If the user message starts with "/", we
-                         * process it as a client command. So far
-                         * only the /nick <newnick> command is implemented. */
-                        if (readbuf[0] == '/') {
-                            /* Remove any trailing newline. */
-                            char *p;
-                            p = strchr(readbuf,'\r'); if (p) *p = 0;
-                            p = strchr(readbuf,'\n'); if (p) *p = 0;
-                            /* Check for an argument of the command, after
-                             * the space. */
-                            char *arg = strchr(readbuf,' ');
-                            if (arg) {
-                                *arg = 0; /* Terminate command name. */
-                                arg++; /* Argument is 1 byte after the space. */
-                            }
-
-                            if (!strcmp(readbuf,"/nick") && arg) {
-                                free(c->nick);
-                                int nicklen = strlen(arg);
-                                c->nick = chatMalloc(nicklen+1);
-                                memcpy(c->nick,arg,nicklen+1);
-                            } else {
-                                /* Unsupported command. Send an error. */
-                                char *errmsg = "Unsupported command\n";
-                                write(c->fd,errmsg,strlen(errmsg));
-                            }
-                        } else {
-                            /* Create a message to send everybody (and show
-                             * on the server console) in the form:
-                             *   nick> some message. */
-                            char msg[256];
-                            int msglen = snprintf(msg, sizeof(msg),
-                                "%s> %s", c->nick, readbuf);
-
-                            /* snprintf() return value may be larger than
-                             * sizeof(msg) in case there is no room for the
-                             * whole output. */
-                            if (msglen >= (int)sizeof(msg))
-                                msglen = sizeof(msg)-1;
-                            printf("%s",msg);
-
-                            /* Send it to all the other clients. */
-                            sendMsgToAllClientsBut(j,msg,msglen);
-                        }
+            /* If the listening socket is "readable", it actually means
+             * there are new clients connections pending to accept. We
+             * accept them in a loop, since with many clients connecting
+             * at the same time accepting a single one per poll() call
+             * would be too slow. This is done after processing the
+             * clients since it may reallocate the pollfds array. */
+            if (Chat->pollfds[0].revents & POLLIN) {
+                for (int j = 0; j < ACCEPT_MAX_PER_CALL; j++) {
+                    int fd = acceptClient(Chat->serversock);
+                    if (fd == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            perror("Accepting client");
+                        break;
                     }
+                    int id = createClient(fd);
+                    /* Send a welcome message. */
+                    char *welcome_msg =
+                        "Welcome to Simple Chat! "
+                        "Use /nick <nick> to set your nick.\n";
+                    writeToClient(id,welcome_msg,strlen(welcome_msg));
+                    printf("Connected client fd=%d\n", fd);
                 }
             }
         } else {
@@ -273,6 +651,7 @@ int main(void) {
              * general this section can be used to wakeup periodically
              * even if there is no clients activity. */
         }
+        flushCapture();
     }
     return 0;
 }